@@ -7,6 +7,8 @@
 #include <variant>
 #include <optional>
 
+#include "rane_caps.h"
+
 namespace rane {
 
     using u8 = uint8_t;
@@ -25,6 +27,9 @@ namespace rane {
     struct ValueId { u32 v = 0; };   // semantic value node id (not SSA)
     struct CapId { u32 v = 0; };   // capability index (global)
 
+    // Fixed-width capability set (rane_caps.h): bit (cap - 1) per capability.
+    using CapSet = cap_mask;
+
     enum class ValueKind : u8 {
         Invalid,
         ConstInt, ConstBool, ConstNull,
@@ -63,7 +68,7 @@ namespace rane {
         ValueKind kind = ValueKind::Invalid;
         TypeId    type{};
         Span      span{};
-        u64       req_caps_mask_hash = 0; // quick-check hash of required caps set for this value/action
+        CapSet    req_caps{};     // caps this value needs (calls: the callee's)
         std::variant<
             std::monostate,
             ConstInt, ConstBool, ConstNull,
@@ -106,7 +111,7 @@ namespace rane {
     struct Action {
         ActionKind kind = ActionKind::Nop;
         Span span{};
-        u64  req_caps_mask_hash = 0; // required caps for this action (enforced vs proc caps)
+        CapSet req_caps{}; // caps this action needs (Rule C0: checked against the proc's declared_caps)
         std::variant<
             std::monostate,
             EvalAction, AssignAction,
@@ -120,11 +125,6 @@ namespace rane {
         std::vector<Action> actions;  // terminator must be Jump / CondJump / Trap / Halt
     };
 
-    struct CapSet {
-        // a compact bitset stored as u64 words (deterministic order)
-        std::vector<u64> words;
-    };
-
     struct ProcPlan {
         SymbolId proc_symbol{};
         TypeId   ret_type{};
@@ -140,10 +140,15 @@ namespace rane {
         std::vector<TypeId>   local_types;
     };
 
+    // Rule C0 on one call edge: the caps `a` needs that `p` did not declare
+    // (empty = allowed). One AND, no per-cap lookups.
+    inline CapSet missing_caps(const ProcPlan& p, const Action& a) {
+        return a.req_caps.missing_from(p.declared_caps);
+    }
+
     struct ActionPlan {
         std::vector<ValueNode> values;   // arena of semantic values
         std::vector<ProcPlan>  procs;
-        std::vector<std::string_view> cap_names; // cap index -> name (interned)
     };
 
 } // namespace rane
@@ -1,5 +1,7 @@
 #include "resolver.cpp"
 
+#include "../rane_keywords.h"
+
 #include <array>
 #include <cstdint>
 #include <iostream>
@@ -15,23 +17,28 @@ namespace rane_syntax {
 
 // ---------------------------------------------------------------------------
 // 0) Reserved / tokenized keywords (kept as an in-code coverage list)
+//    The resolver keywords come first, straight from RANE_KEYWORDS
+//    (rane_keywords.h), so this list cannot drift from the lexer/grammar.
 // ---------------------------------------------------------------------------
+#define RANE_RESERVED_KW(s, k) s,
 static const std::vector<std::string> k_reserved_keywords = {
-  "let","if","then","else","while","do","for","break","continue","return","ret",
-  "proc","def","call","import","export","include","exclude","decide","case","default",
+  RANE_KEYWORDS(RANE_RESERVED_KW)
+  "then","while","do","for","break","continue","ret",
+  "def","call","import","export","include","exclude","decide",
   "jump","goto","mark","label","guard","zone","hot","cold","deterministic","repeat","unroll",
-  "not","and","or","xor","shl","shr","sar","try","catch","throw","define","ifdef","ifndef",
+  "not","and","or","xor","shl","shr","sar","define","ifdef","ifndef",
   "pragma","namespace","enum","struct","class","public","private","protected","static","inline",
   "extern","virtual","const","volatile","constexpr","consteval","constinit","new","del","cast",
-  "type","typealias","alias","mut","immutable","mutable","null","match","pattern","lambda",
+  "type","typealias","alias","mut","immutable","mutable","null","pattern","lambda",
   "handle","target","splice","split","difference","increment","decrement","dedicate","mutex",
-  "ignore","bypass","isolate","separate","join","declaration","compile","score","sys","admin",
+  "ignore","bypass","isolate","separate","declaration","compile","score","sys","admin",
   "plot","peak","point","reg","exception","align","mutate","string","literal","linear","nonlinear",
   "primitives","tuples","member","open","close","module","node","start","set","to","add","by",
   "say","go","halt","mmio","region","read32","write32","trap","choose","addr","load","store",
-  "print","vector","map","channel","spawn","join","lock","with","using","defer","macro","template",
+  "print","vector","map","channel","using","macro","template",
   "generic","asm","syscall","tailcall","profile","optimize","lto"
 };
+#undef RANE_RESERVED_KW
 
 // Helper: print a small sample of reserved keywords
 void print_reserved_sample(std::size_t n = 8) {
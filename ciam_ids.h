@@ -1,4 +1,4 @@
-#pragma// ciam_ids.h
+// ciam_ids.h
 // Deterministic ID allocation for CIAM (guards, tracepoints, blocks, anchors)
 // As of 01_12_2026
 //
@@ -29,6 +29,8 @@
 #include <algorithm>
 #include <array>
 
+#include "rane_lexpath_contract.h"
+
 namespace rane::ciam {
 
     //------------------------------------------------------------------------------
@@ -82,10 +84,10 @@ namespace rane::ciam {
         uint64_t hi = 0;
         uint64_t lo = 0;
 
-        friend bool operator<(stable_key a, stable_key b) {
+        friend constexpr bool operator<(stable_key a, stable_key b) {
             return (a.hi < b.hi) || (a.hi == b.hi && a.lo < b.lo);
         }
-        friend bool operator==(stable_key a, stable_key b) {
+        friend constexpr bool operator==(stable_key a, stable_key b) {
             return a.hi == b.hi && a.lo == b.lo;
         }
     };
@@ -122,31 +124,66 @@ namespace rane::ciam {
     //   - lexical_path (ordinals from root to node)
     //   - rule_id (so two different rules on same node don’t collide)
     //   - “role tag” (guard kind / trace kind / block kind)
-    inline stable_key key_from_lexical_path(
+    //
+    // A lexpath (rane_lexpath_contract.h) flattens to two words per step,
+    // (slot_kind, ordinal), root first. Both overloads fold exactly those
+    // words, so a lexpath_view and its flattened span give the same key.
+    constexpr uint64_t fold_path_word(uint64_t hp, uint32_t x) {
+        uint8_t b[4] = {
+          uint8_t(x & 0xFFu),
+          uint8_t((x >> 8) & 0xFFu),
+          uint8_t((x >> 16) & 0xFFu),
+          uint8_t((x >> 24) & 0xFFu)
+        };
+        hp ^= fnv1a64(std::span<const uint8_t>(b, 4));
+        hp *= 1099511628211ull;
+        return hp;
+    }
+
+    constexpr stable_key finish_path_key(uint64_t stable_seed, sym_id fn, uint64_t hp, uint32_t rule_id, uint32_t role_tag) {
+        uint64_t h1 = stable_seed ^ (uint64_t(fn) << 32) ^ uint64_t(rule_id);
+        uint64_t h2 = 0xA5A5A5A5A5A5A5A5ull ^ uint64_t(role_tag);
+        return mix_key(h1, h2, hp, (uint64_t(fn) << 1) ^ stable_seed);
+    }
+
+    constexpr stable_key key_from_lexical_path(
         uint64_t stable_seed,
         sym_id fn,
         std::span<const uint32_t> path,
         uint32_t rule_id,
         uint32_t role_tag)
     {
-        uint64_t h1 = stable_seed ^ (uint64_t(fn) << 32) ^ uint64_t(rule_id);
-        uint64_t h2 = 0xA5A5A5A5A5A5A5A5ull ^ uint64_t(role_tag);
-
         // fold path deterministically
         uint64_t hp = 1469598103934665603ull;
-        for (uint32_t x : path) {
-            uint8_t b[4] = {
-              uint8_t(x & 0xFFu),
-              uint8_t((x >> 8) & 0xFFu),
-              uint8_t((x >> 16) & 0xFFu),
-              uint8_t((x >> 24) & 0xFFu)
-            };
-            hp ^= fnv1a64(std::span<const uint8_t>(b, 4));
-            hp *= 1099511628211ull;
+        for (uint32_t x : path) hp = fold_path_word(hp, x);
+        return finish_path_key(stable_seed, fn, hp, rule_id, role_tag);
+    }
+
+    // Fast path: hashes the steps where they live (inline buffer or overflow
+    // arena) instead of materializing the flattened vector first.
+    constexpr stable_key key_from_lexical_path(
+        uint64_t stable_seed,
+        sym_id fn,
+        rane::lexpath_view path,
+        uint32_t rule_id,
+        uint32_t role_tag)
+    {
+        uint64_t hp = 1469598103934665603ull;
+        for (uint32_t i = 0; i < path.count; i++) {
+            hp = fold_path_word(hp, uint32_t(path.steps[i].slot));
+            hp = fold_path_word(hp, path.steps[i].ordinal);
         }
+        return finish_path_key(stable_seed, fn, hp, rule_id, role_tag);
+    }
 
-        return mix_key(h1, h2, hp, (uint64_t(fn) << 1) ^ stable_seed);
+    namespace detail {
+        inline constexpr rane::lexpath_step k_probe_steps[] = {
+            { rane::slot_kind::proc_body, 0 }, { rane::slot_kind::block_stmts, 7 }, { rane::slot_kind::call_args, 70000 } };
+        inline constexpr uint32_t k_probe_words[] = { 12, 0, 20, 7, 61, 70000 };
     }
+    static_assert(key_from_lexical_path(1, 2, rane::lexpath_view{ detail::k_probe_steps, 3 }, 3, 4) ==
+        key_from_lexical_path(1, 2, std::span<const uint32_t>(detail::k_probe_words), 3, 4),
+        "lexpath_view must hash like its flattened (slot, ordinal) words");
 
     //------------------------------------------------------------------------------
     // Layer 3: Span Hash fallback (least stable, but deterministic)
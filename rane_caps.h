@@ -0,0 +1,70 @@
+#pragma once
+// rane_caps.h
+// Single source of truth for the capability list + fixed-width capability mask
+// As of 10_16_2026
+//
+// RANE_CAPS(X) expands X(name, value) once per capability. Values are 1-based
+// and match ciam_engine.h `capability`; cap_mask keeps bit (value - 1), the
+// same layout as ciam_engine.h `cap_set` and the exec meta
+// `required_caps_bits` word, so a mask is written out as-is.
+// Consumers:
+//   - Rane_resolver.cpp: CapKind, CiamCtx::required_caps, IR_Inst/IR_Func
+//     masks, syntax.exec.meta (.bin header + JSON mirror)
+//   - actionplan.hpp: ProcPlan::declared_caps, per-value/per-action req_caps
+//
+// Rule C0 (capability check on a call edge) is one AND per edge:
+//   edge_caps.missing_from(proc_caps) is empty <=> the call is allowed.
+//
+// Append new caps at the end (values are ABI); at most 16 fit the mask.
+
+#include <cstdint>
+#include <cstddef>
+#include <array>
+#include <string_view>
+
+#define RANE_CAPS(X)        \
+    X(heap_alloc,   1)      \
+    X(file_io,      2)      \
+    X(network_io,   3)      \
+    X(dynamic_eval, 4)      \
+    X(syscalls,     5)      \
+    X(threads,      6)      \
+    X(channels,     7)      \
+    X(crypto,       8)
+
+namespace rane {
+
+#define RANE_CAP_ENUM(name, v) name = v,
+    enum class cap : uint16_t { RANE_CAPS(RANE_CAP_ENUM) };
+#undef RANE_CAP_ENUM
+
+#define RANE_CAP_NAME(name, v) std::string_view(#name),
+    inline constexpr std::array k_cap_names = { RANE_CAPS(RANE_CAP_NAME) }; // [value - 1]
+#undef RANE_CAP_NAME
+
+    inline constexpr size_t k_cap_count = k_cap_names.size();
+
+    struct cap_mask {
+        uint16_t bits = 0;
+
+        static constexpr cap_mask of(cap c) { return { uint16_t(1u << (uint16_t(c) - 1u)) }; }
+        static constexpr cap_mask all() { return { uint16_t((1u << k_cap_count) - 1u) }; }
+
+        constexpr void add(cap c) { bits |= of(c).bits; }
+        constexpr bool has(cap c) const { return (bits & of(c).bits) != 0; }
+        constexpr bool empty() const { return bits == 0; }
+
+        // Caps in this mask that `granted` does not cover (Rule C0).
+        constexpr cap_mask missing_from(cap_mask granted) const { return { uint16_t(bits & ~granted.bits) }; }
+
+        constexpr cap_mask& operator|=(cap_mask o) { bits |= o.bits; return *this; }
+        friend constexpr cap_mask operator|(cap_mask a, cap_mask b) { return { uint16_t(a.bits | b.bits) }; }
+        friend constexpr cap_mask operator&(cap_mask a, cap_mask b) { return { uint16_t(a.bits & b.bits) }; }
+        friend constexpr bool operator==(cap_mask a, cap_mask b) { return a.bits == b.bits; }
+    };
+
+    static_assert(k_cap_count <= 16, "cap_mask is 16 bits (exec meta required_caps_bits)");
+    static_assert(cap_mask::of(cap::heap_alloc).bits == 1 && cap_mask::of(cap::crypto).bits == 0x80);
+    static_assert(cap_mask::all().missing_from(cap_mask::of(cap::threads)) == (cap_mask::all() & cap_mask{ uint16_t(~0x20u) }));
+
+} // namespace rane
@@ -0,0 +1,104 @@
+#pragma once
+// rane_keywords.h
+// Single source of truth for the resolver keyword set + constexpr perfect hash
+// As of 01_12_2026
+//
+// RANE_KEYWORDS(X) expands X(spelling, TokKind enumerator) once per keyword.
+// Consumers:
+//   - Rane_resolver.cpp: generates the TokKind keyword block and keyword_kind()
+//   - archived/syntax.cpp: seeds k_reserved_keywords
+//   - grammar.ebnf: the `keyword` production mirrors this list (edit both)
+//
+// Order matters: it is the TokKind order. Append new keywords at the end.
+//
+// Lookup is a perfect hash keyed on (length, first char, last char): the
+// multiplier is searched at compile time and static_assert'ed collision-free,
+// so recognizing an identifier costs one table probe + one compare.
+
+#include <cstdint>
+#include <cstddef>
+#include <array>
+#include <string_view>
+
+#define RANE_KEYWORDS(X)       \
+    X("proc",    KwProc)       \
+    X("return",  KwReturn)     \
+    X("let",     KwLet)        \
+    X("end",     KwEnd)        \
+    X("if",      KwIf)         \
+    X("else",    KwElse)       \
+    X("match",   KwMatch)      \
+    X("case",    KwCase)       \
+    X("default", KwDefault)    \
+    X("with",    KwWith)       \
+    X("defer",   KwDefer)      \
+    X("lock",    KwLock)       \
+    X("spawn",   KwSpawn)      \
+    X("join",    KwJoin)       \
+    X("try",     KwTry)        \
+    X("catch",   KwCatch)      \
+    X("finally", KwFinally)    \
+    X("throw",   KwThrow)
+
+namespace rane::lex {
+
+#define RANE_KW_SPELLING(s, k) std::string_view(s),
+    inline constexpr std::array k_keywords = { RANE_KEYWORDS(RANE_KW_SPELLING) };
+#undef RANE_KW_SPELLING
+
+    inline constexpr size_t k_keyword_count = k_keywords.size();
+
+    constexpr size_t kw_len_bound(bool want_max) {
+        size_t r = want_max ? 0 : SIZE_MAX;
+        for (auto k : k_keywords) r = want_max ? (k.size() > r ? k.size() : r) : (k.size() < r ? k.size() : r);
+        return r;
+    }
+    inline constexpr size_t k_keyword_min_len = kw_len_bound(false);
+    inline constexpr size_t k_keyword_max_len = kw_len_bound(true);
+
+    // 64 slots for 18 keywords keeps the seed search short and the table in one cache line.
+    inline constexpr uint32_t k_kw_table_bits = 6;
+
+    constexpr uint32_t kw_slot(size_t len, uint8_t first, uint8_t last, uint32_t seed) {
+        uint32_t h = (uint32_t(first) << 16) ^ (uint32_t(last) << 8) ^ uint32_t(len);
+        return (h * seed) >> (32 - k_kw_table_bits);
+    }
+
+    struct kw_table {
+        uint32_t seed = 0;                                // 0 = search failed
+        std::array<uint8_t, 1u << k_kw_table_bits> slot{}; // keyword index + 1, 0 = empty
+    };
+
+    constexpr kw_table build_kw_table() {
+        uint32_t seed = 0x9E3779B1u;
+        for (int attempt = 0; attempt < 4096; attempt++, seed += 2) {
+            kw_table t;
+            t.seed = seed;
+            bool ok = true;
+            for (size_t i = 0; i < k_keyword_count && ok; i++) {
+                auto k = k_keywords[i];
+                uint32_t s = kw_slot(k.size(), uint8_t(k.front()), uint8_t(k.back()), seed);
+                if (t.slot[s]) ok = false;
+                else t.slot[s] = uint8_t(i + 1);
+            }
+            if (ok) return t;
+        }
+        return {};
+    }
+
+    inline constexpr kw_table k_kw_table = build_kw_table();
+    static_assert(k_kw_table.seed != 0, "no collision-free seed for RANE_KEYWORDS; grow k_kw_table_bits");
+    static_assert(k_keyword_count < 255, "slot entries are uint8_t");
+
+    // Index into k_keywords (== RANE_KEYWORDS order), or -1 for a plain identifier.
+    constexpr int keyword_index(std::string_view s) {
+        if (s.size() < k_keyword_min_len || s.size() > k_keyword_max_len) return -1;
+        uint8_t e = k_kw_table.slot[kw_slot(s.size(), uint8_t(s.front()), uint8_t(s.back()), k_kw_table.seed)];
+        if (!e || k_keywords[e - 1] != s) return -1;
+        return int(e - 1);
+    }
+
+    static_assert(keyword_index("proc") == 0 && keyword_index("throw") == int(k_keyword_count - 1));
+    static_assert(keyword_index("procs") == -1 && keyword_index("x") == -1 && keyword_index("as") == -1);
+
+} // namespace rane::lex
@@ -81,6 +81,8 @@ namespace rane {
 		catch_list = 44,
 		finally_body = 45,
 		throw_expr = 46,
+		let_init = 47,      // initializer expression of let
+		expr_stmt = 48,     // expression of an expression statement
 
 		// Call/expression slots
 		call_callee = 60,
@@ -247,6 +249,10 @@ namespace rane {
 	// - return_expr: expr node (0 if present)
 	// - throw_expr: expr node (0)
 	//
+	// LET / EXPRESSION STATEMENT
+	// - let_init: initializer expr node (0 if present)
+	// - expr_stmt: the statement's expr node (0)
+	//
 	// TRY
 	// - try_body: block node (0)
 	// - catch_list: catch clause nodes in source order